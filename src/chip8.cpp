@@ -6,12 +6,29 @@
 #define GFX_SIZE 2048
 #define KEYPAD_SIZE 16
 #define MEMORY_SIZE 4096
+#define FUSION_THRESHOLD 64 // executions of an address before trying to fuse the sequence starting there
+#define FUSION_MAX_LENGTH 3 // longest fused sequence, in instructions
+
+// Kinds of fused instruction sequences (superinstructions)
+enum FusionKind : uint8_t {
+    FUSION_NONE = 0,     // not profiled enough yet
+    FUSION_REJECTED,     // profiled, but doesn't start a fusable sequence
+    FUSION_SET_DRAW,     // ANNN + DXYN
+    FUSION_LOAD_SKIP_EQ, // 6XNN + 3XNN
+    FUSION_LOAD_SKIP_NE, // 6XNN + 4XNN
+    FUSION_ADD_SKIP_EQ,  // 7XNN + 3XNN
+    FUSION_ADD_SKIP_NE,  // 7XNN + 4XNN
+    FUSION_TIMER_WAIT,   // FX07 + 3XNN + 1NNN
+    FUSION_KIND_COUNT
+};
 
 class Chip8 {
     public:
         bool drawFlag;
         uint8_t gfx[GFX_SIZE];
         uint8_t key[KEYPAD_SIZE]; // keypad
+        uint64_t draw_count; // sprites drawn (DXYN)
+        uint64_t unknown_opcode_count;
 
     void update_timers() {
         // update timers
@@ -100,9 +117,70 @@ class Chip8 {
         // reset timers
         delay_timer = 0;
         sound_timer = 0;
+
+        // reset the fusion profile and statistics
+        for (int i = 0; i < MEMORY_SIZE; i++) {
+            hot_count[i] = 0;
+            fused[i] = FUSION_NONE;
+        }
+
+        for (int i = 0; i < FUSION_KIND_COUNT; i++) {
+            fusion_sites[i] = 0;
+            fusion_dispatches[i] = 0;
+        }
+
+        instructions_retired = 0;
+        fused_instructions_retired = 0;
+        draw_count = 0;
+        unknown_opcode_count = 0;
     }
 
-    void emulate_cycle() {
+    uint64_t get_instructions_retired() {
+        return instructions_retired;
+    }
+
+    void print_fusion_stats(const char *rom_name) {
+        printf("Fusion statistics for ROM %s:\n", rom_name);
+
+        double fused_percent = instructions_retired > 0 ? 100.0 * fused_instructions_retired / instructions_retired : 0.0;
+        printf("  instructions retired: %llu (%llu in fused dispatches, %.1f%%)\n",
+               (unsigned long long) instructions_retired,
+               (unsigned long long) fused_instructions_retired,
+               fused_percent);
+
+        // each fused dispatch replaces one dispatch per instruction it retires
+        uint64_t dispatches_saved = fused_instructions_retired;
+        for (int kind = FUSION_SET_DRAW; kind < FUSION_KIND_COUNT; kind++) {
+            dispatches_saved -= fusion_dispatches[kind];
+            printf("  %-14s sites: %4u  dispatches: %llu\n",
+                   fusion_name[kind],
+                   fusion_sites[kind],
+                   (unsigned long long) fusion_dispatches[kind]);
+        }
+
+        printf("  dispatches saved: %llu\n", (unsigned long long) dispatches_saved);
+    }
+
+    // Executes the instruction at pc, or a fused sequence of at most `budget` instructions starting at pc.
+    // Returns the number of instructions retired.
+    int emulate_cycle(int budget) {
+        if (pc < MEMORY_SIZE) {
+            uint8_t kind = fused[pc];
+
+            if (kind >= FUSION_SET_DRAW) {
+                if (fusion_length[kind] <= budget) {
+                    return emulate_fused(kind);
+                }
+            } else if (kind == FUSION_NONE && ++hot_count[pc] >= FUSION_THRESHOLD) {
+                // hot address: fuse the sequence starting here, if any
+                kind = match_fusion(pc);
+                fused[pc] = kind;
+                fusion_sites[kind]++;
+            }
+        }
+
+        instructions_retired++;
+
         // fetch opcode
         opcode = memory[pc] << 8 | memory[pc+1];
         pc += 2;
@@ -133,6 +211,7 @@ class Chip8 {
                     // default
                     default:
                         printf("Unknown opcode.\n");
+                        unknown_opcode_count++;
                 }
                 break;
             // 1NNN (flow): Jumps to address NNN.
@@ -251,6 +330,7 @@ class Chip8 {
                     }
                     default:
                         printf("Unknown opcode.\n");
+                        unknown_opcode_count++;
                 }
                 break;
             // 9XY0 (cond): Skips the next instruction if VX is not equal to VY.
@@ -281,29 +361,7 @@ class Chip8 {
             //              As described above, VF is set to 1 if any screen pixels are flipped from set to unset when the sprite is drawn,
             //              and to 0 if that doesn't happen.
             case 0xD000: {
-                uint8_t pixel;
-
-                V[0xF] = 0;
-
-                for (int i= 0; i < N; i++) {
-                    pixel = memory[I+i];
-
-                    for (int j= 0; j < 8; j++) {
-                        // If the `jth` bit on the `pixel` is 1, flip the bit on `gfx`
-                        if ((pixel & (0x80 >> j)) != 0) {
-                            // If the bit is `set to unset`
-                            uint16_t idx = (V[X] + j + ((V[Y] + i) * 64)) % GFX_SIZE;
-                            if (gfx[idx] == 1) {
-                                V[0xF] = 1;
-                            }
-
-                            // Flip bit using XOR
-                            gfx[idx] ^= 1;
-                        }
-                    }
-                }
-
-                drawFlag = true;
+                draw_sprite(X, Y, N);
                 break;
             }
             case 0xE000:
@@ -322,6 +380,9 @@ class Chip8 {
                         }
                         break;
                     }
+                    default:
+                        printf("Unknown opcode.\n");
+                        unknown_opcode_count++;
                 }
                 break;
             case 0xF000:
@@ -383,6 +444,7 @@ class Chip8 {
                         memory[I] = V[X] / 100;
                         memory[I+1] = (V[X] / 10) % 10;
                         memory[I+2] = V[X] % 10;
+                        invalidate_fusion(I, 3);
                         break;
                     }
                     // FX55 (MEM): Stores V0 to VX (including VX) in memory starting at address I.
@@ -391,6 +453,7 @@ class Chip8 {
                         for (int i = 0; i <= X; i++) {
                             memory[I+i] = V[i];
                         }
+                        invalidate_fusion(I, X + 1);
                         break;
                     }
                     // FX65 (MEM): Fills V0 to VX with values from memory starting at address I.
@@ -401,13 +464,19 @@ class Chip8 {
                         }
                         break;
                     }
+                    default:
+                        printf("Unknown opcode.\n");
+                        unknown_opcode_count++;
                 }
                 break;
 
             // default
             default:
                 printf("Unknown opcode.\n");
+                unknown_opcode_count++;
         }
+
+        return 1;
     }
 
     private:
@@ -421,6 +490,184 @@ class Chip8 {
         uint16_t stack[16];
         uint16_t sp; // stack pointer
         static uint8_t fontset[FONTSET_SIZE];
+
+        // fusion profile, indexed by the address of the first instruction of a sequence
+        uint8_t hot_count[MEMORY_SIZE];
+        uint8_t fused[MEMORY_SIZE]; // FusionKind
+        static const int fusion_length[FUSION_KIND_COUNT];
+        static const char *fusion_name[FUSION_KIND_COUNT];
+
+        // fusion statistics
+        uint32_t fusion_sites[FUSION_KIND_COUNT];
+        uint64_t fusion_dispatches[FUSION_KIND_COUNT];
+        uint64_t instructions_retired;
+        uint64_t fused_instructions_retired;
+
+    // Draws a sprite at coordinate (VX, VY) with a height of N pixels, read from memory location I (see DXYN).
+    void draw_sprite(uint16_t X, uint16_t Y, uint16_t N) {
+        uint8_t pixel;
+
+        V[0xF] = 0;
+
+        for (int i= 0; i < N; i++) {
+            pixel = memory[I+i];
+
+            for (int j= 0; j < 8; j++) {
+                // If the `jth` bit on the `pixel` is 1, flip the bit on `gfx`
+                if ((pixel & (0x80 >> j)) != 0) {
+                    // If the bit is `set to unset`
+                    uint16_t idx = (V[X] + j + ((V[Y] + i) * 64)) % GFX_SIZE;
+                    if (gfx[idx] == 1) {
+                        V[0xF] = 1;
+                    }
+
+                    // Flip bit using XOR
+                    gfx[idx] ^= 1;
+                }
+            }
+        }
+
+        drawFlag = true;
+        draw_count++;
+    }
+
+    uint16_t opcode_at(uint16_t addr) {
+        return memory[addr] << 8 | memory[addr+1];
+    }
+
+    // Returns the kind of fused sequence starting at `addr`, or FUSION_REJECTED if there's none.
+    uint8_t match_fusion(uint16_t addr) {
+        if (addr + FUSION_MAX_LENGTH * 2 > MEMORY_SIZE) {
+            return FUSION_REJECTED;
+        }
+
+        uint16_t first = opcode_at(addr);
+        uint16_t second = opcode_at(addr + 2);
+        uint16_t third = opcode_at(addr + 4);
+
+        switch (first & 0xF000) {
+            case 0xA000:
+                if ((second & 0xF000) == 0xD000) {
+                    return FUSION_SET_DRAW;
+                }
+                break;
+            case 0x6000:
+                if ((second & 0xF000) == 0x3000) {
+                    return FUSION_LOAD_SKIP_EQ;
+                } else if ((second & 0xF000) == 0x4000) {
+                    return FUSION_LOAD_SKIP_NE;
+                }
+                break;
+            case 0x7000:
+                if ((second & 0xF000) == 0x3000) {
+                    return FUSION_ADD_SKIP_EQ;
+                } else if ((second & 0xF000) == 0x4000) {
+                    return FUSION_ADD_SKIP_NE;
+                }
+                break;
+            case 0xF000:
+                if ((first & 0xF0FF) == 0xF007 && (second & 0xF000) == 0x3000 && (third & 0xF000) == 0x1000) {
+                    return FUSION_TIMER_WAIT;
+                }
+                break;
+        }
+
+        return FUSION_REJECTED;
+    }
+
+    // Forgets fused sequences overlapping the `length` bytes written at `addr` (self-modifying code).
+    void invalidate_fusion(uint16_t addr, int length) {
+        int start = addr - (FUSION_MAX_LENGTH * 2 - 1);
+        int end = addr + length;
+
+        if (start < 0) {
+            start = 0;
+        }
+
+        if (end > MEMORY_SIZE) {
+            end = MEMORY_SIZE;
+        }
+
+        for (int i = start; i < end; i++) {
+            hot_count[i] = 0;
+            fused[i] = FUSION_NONE;
+        }
+    }
+
+    // Executes the fused sequence of the given kind starting at pc, with the same effects as
+    // executing its instructions one at a time. Returns the number of instructions retired.
+    int emulate_fused(uint8_t kind) {
+        uint16_t first = opcode_at(pc);
+        uint16_t second = opcode_at(pc + 2);
+        uint16_t X1 = (first & 0x0F00) >> 8;
+        uint16_t X2 = (second & 0x0F00) >> 8;
+        int length = fusion_length[kind];
+
+        switch (kind) {
+            // ANNN + DXYN
+            case FUSION_SET_DRAW:
+                I = first & 0x0FFF;
+                draw_sprite(X2, (second & 0x00F0) >> 4, second & 0x000F);
+                opcode = second;
+                pc += 4;
+                break;
+            // 6XNN + 3XNN / 4XNN
+            case FUSION_LOAD_SKIP_EQ:
+            case FUSION_LOAD_SKIP_NE:
+            // 7XNN + 3XNN / 4XNN
+            case FUSION_ADD_SKIP_EQ:
+            case FUSION_ADD_SKIP_NE: {
+                if (kind == FUSION_LOAD_SKIP_EQ || kind == FUSION_LOAD_SKIP_NE) {
+                    V[X1] = first & 0x00FF;
+                } else {
+                    V[X1] += first & 0x00FF;
+                }
+
+                bool equal = V[X2] == (second & 0x00FF);
+                bool skip = (kind == FUSION_LOAD_SKIP_EQ || kind == FUSION_ADD_SKIP_EQ) ? equal : !equal;
+
+                opcode = second;
+                pc += skip ? 6 : 4;
+                break;
+            }
+            // FX07 + 3XNN + 1NNN: busy-waits on the delay timer
+            case FUSION_TIMER_WAIT: {
+                V[X1] = delay_timer;
+
+                if (V[X2] == (second & 0x00FF)) {
+                    // the jump is skipped
+                    length = 2;
+                    opcode = second;
+                    pc += 6;
+                } else {
+                    uint16_t third = opcode_at(pc + 4);
+                    opcode = third;
+                    pc = third & 0x0FFF;
+                }
+                break;
+            }
+        }
+
+        fusion_dispatches[kind]++;
+        instructions_retired += length;
+        fused_instructions_retired += length;
+
+        return length;
+    }
+};
+
+const int Chip8::fusion_length[FUSION_KIND_COUNT] = { 1, 1, 2, 2, 2, 2, 2, 3 };
+
+const char *Chip8::fusion_name[FUSION_KIND_COUNT] =
+{
+    "none",
+    "rejected",
+    "ANNN+DXYN",
+    "6XNN+3XNN",
+    "6XNN+4XNN",
+    "7XNN+3XNN",
+    "7XNN+4XNN",
+    "FX07+3XNN+1NNN"
 };
 
 uint8_t Chip8::fontset[FONTSET_SIZE] =
@@ -1,5 +1,9 @@
 #include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
 #include <thread>
+#include <unistd.h>
 #include <SDL2/SDL.h>
 #define KEYPAD_SIZE 16
 #define WIDTH 64
@@ -9,6 +13,7 @@
 #define SCALE 10
 
 #include "chip8.cpp"
+#include "metrics.cpp"
 
 const int SCREEN_WIDTH = WIDTH * SCALE;
 const int SCREEN_HEIGHT = HEIGHT * SCALE;
@@ -38,6 +43,10 @@ void draw_frame(SDL_Texture* texture, SDL_Renderer* renderer, uint32_t* pixels)
     SDL_RenderPresent(renderer);
 }
 
+uint64_t elapsed_us(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
 int main(int argc, char *argv[]) {
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;
@@ -85,15 +94,53 @@ int main(int argc, char *argv[]) {
 
     int ipf = IPS/FPS; // instructions per frame
 
+    // Metrics are served on $CHIP8_METRICS_SOCKET, or /tmp/chip8-<pid>.sock by default
+    Metrics metrics;
+    MetricsServer metrics_server;
+    std::string metrics_socket_path;
+    const char *metrics_socket_env = getenv("CHIP8_METRICS_SOCKET");
+
+    if (metrics_socket_env != NULL) {
+        metrics_socket_path = metrics_socket_env;
+    } else {
+        metrics_socket_path = "/tmp/chip8-" + std::to_string(getpid()) + ".sock";
+    }
+
+    if (!metrics_server.start(&metrics, metrics_socket_path.c_str())) {
+        printf("Running without metrics.\n");
+    }
+
+    const std::chrono::milliseconds frame_sleep(1000/60);
+    const uint64_t frame_budget_us = 1000000 / FPS;
+    std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+
     while (!quit) {
+        std::chrono::steady_clock::time_point emulation_start = std::chrono::steady_clock::now();
+
+        // a loop iteration that took N frame budgets missed N-1 frames
+        uint64_t frame_period_us = elapsed_us(frame_start, emulation_start);
+        if (metrics.frames.load(std::memory_order_relaxed) > 0) {
+            uint64_t missed = frame_period_us / frame_budget_us;
+            metrics.dropped_frames.record(missed > 0 ? missed - 1 : 0);
+        }
+        frame_start = emulation_start;
+
         // perform the instructions before ticking the timers
-        for (int i = 0; i < ipf; i++) {
-            chip8.emulate_cycle();
+        // (a fused sequence retires several instructions at once, but never more than what's left of the frame)
+        for (int i = 0; i < ipf; ) {
+            i += chip8.emulate_cycle(ipf - i);
         }
 
         chip8.update_timers();
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000/60)); // 16.667 milliseconds should be "almost" accurate
+        std::chrono::steady_clock::time_point sleep_start = std::chrono::steady_clock::now();
+        metrics.frame_emulation_time.record(elapsed_us(emulation_start, sleep_start));
+
+        std::this_thread::sleep_for(frame_sleep); // 16.667 milliseconds should be "almost" accurate
+
+        uint64_t slept_us = elapsed_us(sleep_start, std::chrono::steady_clock::now());
+        uint64_t requested_us = std::chrono::duration_cast<std::chrono::microseconds>(frame_sleep).count();
+        metrics.sleep_overshoot.record(slept_us > requested_us ? slept_us - requested_us : 0);
 
         while (SDL_PollEvent(&e)) { // 1 if there's an event, 0 if none
             // user requests to quit
@@ -130,10 +177,22 @@ int main(int argc, char *argv[]) {
                 // but bit ops are fancier ;)
             }
 
+            std::chrono::steady_clock::time_point present_start = std::chrono::steady_clock::now();
             draw_frame(texture, renderer, pixels);
+            metrics.present_time.record(elapsed_us(present_start, std::chrono::steady_clock::now()));
         }
+
+        // publish the emulator's counters once per frame
+        metrics.frames.fetch_add(1, std::memory_order_relaxed);
+        metrics.instructions.store(chip8.get_instructions_retired(), std::memory_order_relaxed);
+        metrics.draws.store(chip8.draw_count, std::memory_order_relaxed);
+        metrics.unknown_opcodes.store(chip8.unknown_opcode_count, std::memory_order_relaxed);
     }
 
+    metrics_server.stop();
+
+    chip8.print_fusion_stats(argv[1]);
+
     SDL_DestroyWindow(window);
     SDL_Quit();
 
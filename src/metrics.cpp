@@ -0,0 +1,310 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define HISTOGRAM_BUCKETS 64
+#define METRICS_REQUEST_SIZE 64
+#define METRICS_ACCEPT_BACKOFF_MS 100 // wait after a failed accept(), e.g. when out of file descriptors
+
+// Lock-free histogram with power-of-two buckets.
+// Bucket 0 holds 0, bucket b (b > 0) holds values in [2^(b-1), 2^b).
+// Recording is a handful of relaxed atomic adds, so it is safe to call from the emulation loop
+// while another thread takes a snapshot.
+class Histogram {
+    public:
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+
+    Histogram() {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+
+        count.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value) {
+        int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        if (bucket >= HISTOGRAM_BUCKETS) {
+            bucket = HISTOGRAM_BUCKETS - 1;
+        }
+
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+
+        // only the emulation thread records, so a plain compare is enough
+        if (value > max.load(std::memory_order_relaxed)) {
+            max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the upper bound of the bucket containing the given quantile (0.0 - 1.0).
+    uint64_t quantile(double q) {
+        uint64_t total = count.load(std::memory_order_relaxed);
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t) (q * total);
+        uint64_t seen = 0;
+
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return i == 0 ? 0 : (i == HISTOGRAM_BUCKETS - 1 ? UINT64_MAX : (1ULL << i) - 1);
+            }
+        }
+
+        return max.load(std::memory_order_relaxed);
+    }
+};
+
+// Runtime metrics of the emulator. Written by the emulation loop, read by the metrics server.
+class Metrics {
+    public:
+        // durations are in microseconds
+        Histogram frame_emulation_time;
+        Histogram present_time;
+        Histogram sleep_overshoot;
+        Histogram dropped_frames; // frames missed per loop iteration
+
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> instructions;
+        std::atomic<uint64_t> draws;
+        std::atomic<uint64_t> unknown_opcodes;
+
+    Metrics() {
+        frames.store(0, std::memory_order_relaxed);
+        instructions.store(0, std::memory_order_relaxed);
+        draws.store(0, std::memory_order_relaxed);
+        unknown_opcodes.store(0, std::memory_order_relaxed);
+    }
+
+    std::string snapshot_text() {
+        std::string out;
+        char line[256];
+
+        snprintf(line, sizeof(line),
+                 "frames %llu\ninstructions %llu\ndraws %llu\nunknown_opcodes %llu\n",
+                 load(frames), load(instructions), load(draws), load(unknown_opcodes));
+        out += line;
+
+        append_histogram_text(out, "frame_emulation_time_us", frame_emulation_time);
+        append_histogram_text(out, "present_time_us", present_time);
+        append_histogram_text(out, "sleep_overshoot_us", sleep_overshoot);
+        append_histogram_text(out, "dropped_frames", dropped_frames);
+
+        return out;
+    }
+
+    std::string snapshot_json() {
+        std::string out;
+        char line[256];
+
+        snprintf(line, sizeof(line),
+                 "{\"frames\":%llu,\"instructions\":%llu,\"draws\":%llu,\"unknown_opcodes\":%llu",
+                 load(frames), load(instructions), load(draws), load(unknown_opcodes));
+        out += line;
+
+        append_histogram_json(out, "frame_emulation_time_us", frame_emulation_time);
+        append_histogram_json(out, "present_time_us", present_time);
+        append_histogram_json(out, "sleep_overshoot_us", sleep_overshoot);
+        append_histogram_json(out, "dropped_frames", dropped_frames);
+
+        out += "}\n";
+        return out;
+    }
+
+    private:
+    static unsigned long long load(std::atomic<uint64_t> &counter) {
+        return (unsigned long long) counter.load(std::memory_order_relaxed);
+    }
+
+    static void append_histogram_text(std::string &out, const char *name, Histogram &h) {
+        char line[256];
+
+        snprintf(line, sizeof(line), "%s count=%llu sum=%llu max=%llu p50=%llu p90=%llu p99=%llu\n",
+                 name, load(h.count), load(h.sum), load(h.max),
+                 (unsigned long long) h.quantile(0.50),
+                 (unsigned long long) h.quantile(0.90),
+                 (unsigned long long) h.quantile(0.99));
+        out += line;
+    }
+
+    static void append_histogram_json(std::string &out, const char *name, Histogram &h) {
+        char line[256];
+
+        snprintf(line, sizeof(line), ",\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+                 name, load(h.count), load(h.sum), load(h.max),
+                 (unsigned long long) h.quantile(0.50),
+                 (unsigned long long) h.quantile(0.90),
+                 (unsigned long long) h.quantile(0.99));
+        out += line;
+
+        // trailing empty buckets are left out
+        int last = HISTOGRAM_BUCKETS - 1;
+        while (last > 0 && h.buckets[last].load(std::memory_order_relaxed) == 0) {
+            last--;
+        }
+
+        for (int i = 0; i <= last; i++) {
+            snprintf(line, sizeof(line), i == 0 ? "%llu" : ",%llu", load(h.buckets[i]));
+            out += line;
+        }
+
+        out += "]}";
+    }
+};
+
+// Serves snapshots of `Metrics` over a Unix-domain socket.
+// A client connects, optionally sends "json" or "text" (the default) followed by a newline,
+// and receives a single snapshot before the connection is closed.
+class MetricsServer {
+    public:
+    MetricsServer() {
+        listen_fd = -1;
+        running = false;
+    }
+
+    bool start(Metrics *metrics, const char *socket_path) {
+        struct sockaddr_un addr;
+
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            printf("Metrics socket path too long.\n");
+            return false;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socket_path);
+
+        if (!remove_stale_socket(&addr)) {
+            return false;
+        }
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            printf("Failed to create metrics socket.\n");
+            return false;
+        }
+
+        if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+            printf("Failed to bind metrics socket %s.\n", socket_path);
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        path = socket_path;
+        this->metrics = metrics;
+        running = true;
+        thread = std::thread(&MetricsServer::serve, this);
+
+        printf("Serving metrics on %s\n", socket_path);
+        return true;
+    }
+
+    void stop() {
+        if (!running) {
+            return;
+        }
+
+        running = false;
+        shutdown(listen_fd, SHUT_RDWR); // wakes up the blocking accept()
+        thread.join();
+
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path.c_str());
+    }
+
+    private:
+        int listen_fd;
+        std::atomic<bool> running;
+        std::thread thread;
+        std::string path;
+        Metrics *metrics;
+
+    // Removes a socket left behind by a previous run that is no longer listening.
+    // Returns false if the path is taken by anything else (a regular file, or a running instance's socket).
+    static bool remove_stale_socket(struct sockaddr_un *addr) {
+        struct stat st;
+
+        if (lstat(addr->sun_path, &st) < 0) {
+            return errno == ENOENT;
+        }
+
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("Metrics socket path %s exists and is not a socket.\n", addr->sun_path);
+            return false;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            printf("Failed to create metrics socket.\n");
+            return false;
+        }
+
+        int result = connect(fd, (struct sockaddr *) addr, sizeof(*addr));
+        int connect_errno = errno;
+        close(fd);
+
+        if (result == 0 || connect_errno != ECONNREFUSED) {
+            printf("Metrics socket %s is in use.\n", addr->sun_path);
+            return false;
+        }
+
+        return unlink(addr->sun_path) == 0;
+    }
+
+    void serve() {
+        while (running) {
+            int client_fd = accept(listen_fd, NULL, NULL);
+            if (client_fd < 0) {
+                if (!running) {
+                    break; // woken up by stop()
+                }
+
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_ACCEPT_BACKOFF_MS));
+                }
+                continue;
+            }
+
+            // don't let an idle client block the server
+            struct timeval timeout = { 1, 0 };
+            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            char request[METRICS_REQUEST_SIZE];
+            ssize_t received = recv(client_fd, request, sizeof(request) - 1, 0);
+            request[received > 0 ? received : 0] = '\0';
+
+            std::string response = strncmp(request, "json", 4) == 0 ? metrics->snapshot_json() : metrics->snapshot_text();
+
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+
+            close(client_fd);
+        }
+    }
+};